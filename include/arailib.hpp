@@ -11,6 +11,7 @@
 #include <sstream>
 #include <chrono>
 #include <exception>
+#include <functional>
 #include <stdexcept>
 #include <omp.h>
 #include <json.hpp>
@@ -178,6 +179,10 @@ namespace arailib {
 
     const int n_max_threads = omp_get_max_threads();
 
+    bool is_csv(const string& path) {
+        return (path.rfind(".csv", path.size()) < path.size());
+    }
+
     template <typename T = double>
     Dataset<T> load_data(const string& path, int n = 0) {
         // file path
@@ -211,6 +216,44 @@ namespace arailib {
         return series;
     }
 
+    // streaming counterpart of load_data: calls f with one chunk of data at a time
+    // (one file in dir mode, chunk_size lines in csv mode)
+    template <typename T = double, typename F>
+    void for_each_chunk(const string& path, int n, F f, size_t chunk_size = 1000) {
+        // file path
+        if (is_csv(path)) {
+            ifstream ifs(path);
+            if (!ifs) throw runtime_error("Can't open file!");
+            string line;
+            auto chunk = Dataset<T>();
+            for (size_t i = 0; (i < n) && std::getline(ifs, line); ++i) {
+                chunk.push_back(Data<T>(i, split<T>(line)));
+                if (chunk.size() == chunk_size) {
+                    f(chunk);
+                    chunk.clear();
+                }
+            }
+            if (!chunk.empty()) f(chunk);
+            return;
+        }
+
+        // dir path
+        for (int i = 0; i < n; i++) {
+            const string data_path = path + '/' + to_string(i) + ".csv";
+            ifstream ifs(data_path);
+            if (!ifs) throw runtime_error("Can't open file!");
+            string line;
+            auto chunk = Dataset<T>();
+            while (getline(ifs, line)) {
+                auto v = split<T>(line);
+                const auto id = static_cast<size_t>(v[0]);
+                v.erase(v.begin());
+                chunk.push_back(Data<T>(id, v));
+            }
+            f(chunk);
+        }
+    }
+
     template<typename T>
     void write_csv(const std::vector<T> &v, const std::string &path) {
         std::ofstream ofs(path);
@@ -240,27 +283,197 @@ namespace arailib {
         return chrono::duration_cast<chrono::microseconds>(end - start).count();
     }
 
-    bool is_csv(const string& path) {
-        return (path.rfind(".csv", path.size()) < path.size());
+    template <typename T>
+    vector<double> squared_norms(const Dataset<T>& series) {
+        vector<double> norms(series.size());
+#pragma omp parallel for
+        for (size_t i = 0; i < series.size(); i++) {
+            const auto x = series[i].x.data();
+            const size_t dim = series[i].size();
+            double norm = 0;
+#pragma omp simd reduction(+:norm)
+            for (size_t d = 0; d < dim; d++) norm += x[d] * x[d];
+            norms[i] = norm;
+        }
+        return norms;
     }
 
+    // Blocked exact scan of queries against dataset.  visit(thread_id, query_index,
+    // data_index, dist) is called once per pair with a defined distance (angular
+    // distance to the origin is not); each thread visits a disjoint set of data
+    // blocks.  For a batch of queries, euclidean distances are computed from dot
+    // products and squared norms, so a block is a small GEMM; a single query uses
+    // the direct (q - x)^2 kernel, which reads the dataset once and does not lose
+    // precision to cancellation.  data_norms are squared_norms(dataset); pass them
+    // when scanning the same dataset repeatedly, or they are computed on the fly.
+    template <typename T, typename Visitor>
+    void scan(const Dataset<T>& queries, const Dataset<T>& dataset,
+              const string& distance, Visitor visit,
+              const vector<double>& data_norms = vector<double>()) {
+        select_distance(distance);
+        const size_t query_block = 64, data_block = 256;
+        const size_t n_query = queries.size(), n = dataset.size();
+        if (n_query == 0 || n == 0) return;
+        const size_t dim = queries[0].size();
+        const bool is_euclidean = (distance == "euclidean");
+        const bool is_angular = (distance == "angular");
+        const bool use_dot = is_angular || (is_euclidean && n_query > 1);
+        const bool has_norms = (data_norms.size() == n);
+
+        const auto query_norms = use_dot ? squared_norms(queries) : vector<double>();
+        // norms of a batch are computed up front; a single angular query
+        // accumulates them in the same pass as the dot products
+        const auto computed_norms = (use_dot && !has_norms && n_query > 1) ? squared_norms(dataset)
+                                                                             : vector<double>();
+        const auto& norms = has_norms ? data_norms : computed_norms;
+        const bool accumulate_norms = use_dot && norms.size() != n;
+
+        const size_t n_data_blocks = (n + data_block - 1) / data_block;
+#pragma omp parallel
+        {
+            const int thread_id = omp_get_thread_num();
+            vector<double> block(query_block * data_block);
+            vector<double> block_norms(accumulate_norms ? data_block : 0);
+
+#pragma omp for schedule(dynamic)
+            for (size_t db = 0; db < n_data_blocks; db++) {
+                const size_t d_begin = db * data_block, d_end = min(n, d_begin + data_block);
+                for (size_t q_begin = 0; q_begin < n_query; q_begin += query_block) {
+                    const size_t q_end = min(n_query, q_begin + query_block);
+
+                    for (size_t qi = q_begin; qi < q_end; qi++) {
+                        const auto q = queries[qi].x.data();
+                        auto row = block.data() + (qi - q_begin) * data_block;
+                        for (size_t di = d_begin; di < d_end; di++) {
+                            const auto x = dataset[di].x.data();
+                            double acc = 0;
+                            if (accumulate_norms) {
+                                double norm = 0;
+#pragma omp simd reduction(+:acc, norm)
+                                for (size_t d = 0; d < dim; d++) {
+                                    acc += q[d] * x[d];
+                                    norm += x[d] * x[d];
+                                }
+                                block_norms[di - d_begin] = norm;
+                            } else if (use_dot) {
+#pragma omp simd reduction(+:acc)
+                                for (size_t d = 0; d < dim; d++) acc += q[d] * x[d];
+                            } else if (is_euclidean) {
+#pragma omp simd reduction(+:acc)
+                                for (size_t d = 0; d < dim; d++) acc += (q[d] - x[d]) * (q[d] - x[d]);
+                            } else {
+#pragma omp simd reduction(+:acc)
+                                for (size_t d = 0; d < dim; d++) acc += std::abs(q[d] - x[d]);
+                            }
+                            row[di - d_begin] = acc;
+                        }
+                    }
+
+                    for (size_t qi = q_begin; qi < q_end; qi++) {
+                        const auto row = block.data() + (qi - q_begin) * data_block;
+                        for (size_t di = d_begin; di < d_end; di++) {
+                            const double acc = row[di - d_begin];
+                            const double norm = accumulate_norms ? block_norms[di - d_begin]
+                                                                 : (use_dot ? norms[di] : 0);
+                            float dist;
+                            if (is_euclidean && use_dot) {
+                                const double sq = query_norms[qi] + norm - 2 * acc;
+                                dist = std::sqrt(max(sq, 0.0));
+                            } else if (is_euclidean) {
+                                dist = std::sqrt(acc);
+                            } else if (is_angular) {
+                                const double cos = acc / std::sqrt(query_norms[qi] * norm);
+                                dist = acos(clip(cos, -1.0, 1.0)) / pi;
+                            } else dist = acc;
+                            if (!std::isnan(dist)) visit(thread_id, qi, di, dist);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // k nearest neighbours of each query, ordered by distance and then by position
     template <typename T>
-    auto scan_knn_search(const Data<T>& query, int k, const Dataset<T> dataset,
-                         string distance = "euclidean") {
-        const auto df = select_distance(distance);
-        map<float, reference_wrapper<const Data<T>>> result_map;
-        for (const auto& data : dataset) {
-            const auto dist = euclidean_distance(query, data);
-            result_map.emplace(dist, data);
-            if (result_map.size() > k) result_map.erase(--result_map.cend());
+    auto scan_knn_search(const Dataset<T>& queries, int k, const Dataset<T>& dataset,
+                         const string& distance = "euclidean",
+                         const vector<double>& data_norms = vector<double>()) {
+        using Neighbor = pair<float, size_t>;
+        const int n_threads = omp_get_max_threads();
+        // heaps[thread][query] keeps the k smallest (distance, index) pairs
+        vector<vector<vector<Neighbor>>> heaps(
+                n_threads, vector<vector<Neighbor>>(queries.size()));
+
+        scan(queries, dataset, distance,
+             [&](int thread_id, size_t qi, size_t di, float dist) {
+                 auto& heap = heaps[thread_id][qi];
+                 const auto neighbor = Neighbor(dist, di);
+                 if (heap.size() < static_cast<size_t>(k)) {
+                     heap.push_back(neighbor);
+                     push_heap(heap.begin(), heap.end());
+                 } else if (k > 0 && neighbor < heap.front()) {
+                     pop_heap(heap.begin(), heap.end());
+                     heap.back() = neighbor;
+                     push_heap(heap.begin(), heap.end());
+                 }
+             }, data_norms);
+
+        vector<RefSeries<T>> results(queries.size());
+#pragma omp parallel for
+        for (size_t qi = 0; qi < queries.size(); qi++) {
+            vector<Neighbor> neighbors;
+            for (const auto& thread_heaps : heaps) {
+                const auto& heap = thread_heaps[qi];
+                neighbors.insert(neighbors.end(), heap.begin(), heap.end());
+            }
+            sort(neighbors.begin(), neighbors.end());
+            if (neighbors.size() > static_cast<size_t>(k)) neighbors.resize(k);
+            for (const auto& neighbor : neighbors) {
+                results[qi].emplace_back(cref(dataset[neighbor.second]));
+            }
         }
+        return results;
+    }
+
+    template <typename T>
+    auto scan_knn_search(const Data<T>& query, int k, const Dataset<T>& dataset,
+                         const string& distance = "euclidean",
+                         const vector<double>& data_norms = vector<double>()) {
+        return scan_knn_search(Dataset<T>{query}, k, dataset, distance, data_norms)[0];
+    }
 
-        RefSeries<T> result;
-        for (const auto& result_pair : result_map) {
-            result.emplace_back(result_pair.second);
+    // all points strictly closer than range to each query, in dataset order
+    template <typename T>
+    auto scan_range_search(const Dataset<T>& queries, double range, const Dataset<T>& dataset,
+                           const string& distance = "euclidean",
+                           const vector<double>& data_norms = vector<double>()) {
+        const int n_threads = omp_get_max_threads();
+        vector<vector<vector<size_t>>> hits(
+                n_threads, vector<vector<size_t>>(queries.size()));
+
+        scan(queries, dataset, distance,
+             [&](int thread_id, size_t qi, size_t di, float dist) {
+                 if (dist < range) hits[thread_id][qi].push_back(di);
+             }, data_norms);
+
+        vector<RefSeries<T>> results(queries.size());
+#pragma omp parallel for
+        for (size_t qi = 0; qi < queries.size(); qi++) {
+            vector<size_t> indices;
+            for (const auto& thread_hits : hits) {
+                indices.insert(indices.end(), thread_hits[qi].begin(), thread_hits[qi].end());
+            }
+            sort(indices.begin(), indices.end());
+            for (const auto& di : indices) results[qi].emplace_back(cref(dataset[di]));
         }
+        return results;
+    }
 
-        return result;
+    template <typename T>
+    auto scan_range_search(const Data<T>& query, double range, const Dataset<T>& dataset,
+                           const string& distance = "euclidean",
+                           const vector<double>& data_norms = vector<double>()) {
+        return scan_range_search(Dataset<T>{query}, range, dataset, distance, data_norms)[0];
     }
 }
 
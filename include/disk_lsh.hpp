@@ -0,0 +1,483 @@
+#ifndef LSH_DISK_LSH_HPP
+#define LSH_DISK_LSH_HPP
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <set>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <arailib.hpp>
+#include <lsh.hpp>
+
+using namespace std;
+using namespace arailib;
+
+namespace lsh {
+    struct File {
+        int fd = -1;
+
+        File() = default;
+
+        File(const string& path, int flags) : fd(::open(path.c_str(), flags, 0644)) {
+            if (fd < 0) throw runtime_error("Can't open file!");
+        }
+
+        File(File&& o) noexcept : fd(o.fd) { o.fd = -1; }
+
+        File& operator=(File&& o) noexcept {
+            swap(fd, o.fd);
+            return *this;
+        }
+
+        ~File() { if (fd >= 0) ::close(fd); }
+
+        void read(void* buf, size_t size, uint64_t offset) const {
+            auto p = static_cast<char*>(buf);
+            while (size > 0) {
+                const auto n_read = ::pread(fd, p, size, offset);
+                if (n_read <= 0) throw runtime_error("Can't read file!");
+                p += n_read, size -= n_read, offset += n_read;
+            }
+        }
+
+        void write(const void* buf, size_t size, uint64_t offset) const {
+            auto p = static_cast<const char*>(buf);
+            while (size > 0) {
+                const auto n_written = ::pwrite(fd, p, size, offset);
+                if (n_written <= 0) throw runtime_error("Can't write file!");
+                p += n_written, size -= n_written, offset += n_written;
+            }
+        }
+    };
+
+    // Out-of-core LSH index. Files in dir:
+    //   vectors.bin   records (uint64 id, dim doubles), grouped by bucket of the
+    //                 first table so that bucket contents share pages
+    //   buckets.bin   slot lists (record positions) of every bucket, table by table
+    //   directory.bin bucket key -> (offset in buckets.bin, size), loaded into RAM
+    //   projections.bin  the a and b of every hash function, so that the index
+    //                 hashes the same way whichever standard library reopens it
+    //   meta.json     parameters needed to reopen the index
+    // Queries run in batches: all bucket reads of a batch, then all record reads,
+    // are issued as parallel preads, and records close on disk are coalesced into
+    // a single read of at most max_run bytes. Recently read buckets are kept in
+    // an in-memory LRU holding up to hot_bucket_capacity slots.
+    struct DiskLSHIndex {
+        using Slot = uint64_t; // position of a record in vectors.bin
+        struct BucketRef {
+            uint64_t offset;
+            uint64_t size;
+        };
+        using Directory = unordered_map<vector<int>, BucketRef, VectorHash>;
+
+        LSHIndex hash; // only its hash families are used
+        string dir;
+        size_t n = 0;
+        int dim = 0;
+        size_t record_size = 0;
+        vector<Directory> directory;
+        File vector_file, bucket_file;
+        LRUCache<BucketKeys, vector<Slot>, BucketKeysHash> hot_buckets;
+        // records closer than this on disk are read together, in reads of at most max_run
+        size_t max_gap = 4096;
+        size_t max_run = 4 << 20;
+
+        unsigned long n_bucket_read = 0, n_bucket_hit = 0;
+        unsigned long n_read = 0, n_read_bytes = 0;
+
+        DiskLSHIndex(int n_hash_func_, double w, int L, string distance = "euclidean",
+                     size_t hot_bucket_capacity = 1 << 20) :
+                hash(n_hash_func_, w, L, distance),
+                directory(L), hot_buckets(hot_bucket_capacity) {}
+
+        void reset(const string& dir_) {
+            dir = dir_;
+            n = 0;
+            dim = 0;
+            record_size = 0;
+            directory = vector<Directory>(hash.L);
+            hot_buckets = LRUCache<BucketKeys, vector<Slot>, BucketKeysHash>(hot_buckets.capacity);
+            n_bucket_read = n_bucket_hit = n_read = n_read_bytes = 0;
+        }
+
+        void build(const string& data_path, int n_data, const string& dir_) {
+            reset(dir_);
+            mkdir(dir.c_str(), 0755);
+            const auto tmp_path = dir + "/vectors.tmp";
+
+            // pass 1: records in input order, bucketed by the first table
+            unordered_map<vector<int>, vector<Slot>, VectorHash> buckets;
+            {
+                const auto tmp_file = File(tmp_path, O_RDWR | O_CREAT | O_TRUNC);
+                for_each_chunk(data_path, n_data, [&](const Dataset<>& chunk) {
+                    if (chunk.empty()) return;
+                    if (n == 0) {
+                        hash.create_hash_families(chunk[0].size());
+                        dim = hash.dim;
+                        record_size = sizeof(uint64_t) + dim * sizeof(double);
+                    }
+
+                    auto keys = vector<vector<int>>(chunk.size());
+                    vector<char> buf(chunk.size() * record_size);
+#pragma omp parallel for
+                    for (int i = 0; i < chunk.size(); i++) {
+                        keys[i] = hash.G[0](chunk[i]);
+                        encode(chunk[i], buf.data() + i * record_size);
+                    }
+                    tmp_file.write(buf.data(), buf.size(), n * record_size);
+                    for (const auto& key : keys) buckets[key].emplace_back(n++);
+                });
+                if (n == 0) {
+                    unlink(tmp_path.c_str());
+                    throw runtime_error("no data to build the index from");
+                }
+
+                // pass 2: copy records into vectors.bin in bucket order
+                vector_file = File(dir + "/vectors.bin", O_RDWR | O_CREAT | O_TRUNC);
+                vector<Slot> order;
+                const auto keys = sorted_keys(buckets);
+                for (const auto& key : keys) {
+                    auto& slots = buckets[key];
+                    const auto first = static_cast<Slot>(order.size());
+                    order.insert(order.end(), slots.begin(), slots.end());
+                    iota(slots.begin(), slots.end(), first);
+                }
+
+                const size_t chunk_size = 4096;
+                vector<char> buf(chunk_size * record_size);
+                for (size_t begin = 0; begin < n; begin += chunk_size) {
+                    const auto end = min(n, begin + chunk_size);
+#pragma omp parallel for
+                    for (size_t slot = begin; slot < end; slot++) {
+                        tmp_file.read(buf.data() + (slot - begin) * record_size,
+                                      record_size, order[slot] * record_size);
+                    }
+                    vector_file.write(buf.data(), (end - begin) * record_size, begin * record_size);
+                }
+            }
+            unlink(tmp_path.c_str());
+
+            bucket_file = File(dir + "/buckets.bin", O_RDWR | O_CREAT | O_TRUNC);
+            uint64_t offset = 0;
+            write_buckets(0, buckets, offset);
+
+            // pass 3: one sequential read of vectors.bin per remaining table
+            for (int t = 1; t < hash.L; t++) {
+                buckets.clear();
+                const size_t chunk_size = 4096;
+                vector<char> buf(chunk_size * record_size);
+                for (size_t begin = 0; begin < n; begin += chunk_size) {
+                    const auto end = min(n, begin + chunk_size);
+                    vector_file.read(buf.data(), (end - begin) * record_size, begin * record_size);
+                    auto keys = vector<vector<int>>(end - begin);
+#pragma omp parallel for
+                    for (size_t slot = begin; slot < end; slot++) {
+                        keys[slot - begin] = hash.G[t](decode(buf.data() + (slot - begin) * record_size));
+                    }
+                    for (size_t slot = begin; slot < end; slot++) {
+                        buckets[keys[slot - begin]].emplace_back(slot);
+                    }
+                }
+                write_buckets(t, buckets, offset);
+            }
+
+            save_meta();
+        }
+
+        void open(const string& dir_) {
+            reset(dir_);
+            const auto meta = read_config(dir + "/meta.json");
+            if (meta["m"] != hash.m || meta["w"] != hash.w || meta["L"] != hash.L ||
+                meta["distance"] != hash.distance_type)
+                throw runtime_error("index parameters do not match");
+            n = meta["n"];
+            load_projections();
+            dim = hash.dim;
+            record_size = sizeof(uint64_t) + dim * sizeof(double);
+
+            vector_file = File(dir + "/vectors.bin", O_RDONLY);
+            bucket_file = File(dir + "/buckets.bin", O_RDONLY);
+
+            ifstream ifs(dir + "/directory.bin", ios::binary);
+            if (!ifs) throw runtime_error("Can't open file!");
+            for (int t = 0; t < hash.L; t++) {
+                uint64_t n_bucket;
+                ifs.read(reinterpret_cast<char*>(&n_bucket), sizeof(n_bucket));
+                directory[t].reserve(n_bucket);
+                for (uint64_t i = 0; i < n_bucket; i++) {
+                    auto key = vector<int>(hash.m);
+                    auto ref = BucketRef();
+                    ifs.read(reinterpret_cast<char*>(key.data()), hash.m * sizeof(int));
+                    ifs.read(reinterpret_cast<char*>(&ref.offset), sizeof(ref.offset));
+                    ifs.read(reinterpret_cast<char*>(&ref.size), sizeof(ref.size));
+                    directory[t].emplace(key, ref);
+                }
+            }
+            if (!ifs) throw runtime_error("Can't read file!");
+
+            struct stat st;
+            if (fstat(vector_file.fd, &st) != 0) throw runtime_error("Can't read file!");
+            if (static_cast<uint64_t>(st.st_size) != n * record_size)
+                throw runtime_error("vectors.bin does not match the index size");
+        }
+
+        // time of each result is the time of the whole batch divided by its size
+        auto range_search(const Dataset<>& queries, double range) {
+            const auto start = get_now();
+            auto candidates = gather(queries);
+
+#pragma omp parallel for
+            for (int q = 0; q < queries.size(); q++) {
+                auto& result = candidates.results[q];
+                for (const auto& slot : candidates.slots[q]) {
+                    const auto& data = candidates.record(slot);
+                    if (hash.distance_function(queries[q], data) < range)
+                        result.result.emplace_back(data.id);
+                }
+            }
+
+            return finish(candidates.results, start);
+        }
+
+        auto range_search(const Data<>& query, double range) {
+            return range_search(Dataset<>{query}, range)[0];
+        }
+
+        auto knn_search(const Dataset<>& queries, int k) {
+            const auto start = get_now();
+            auto candidates = gather(queries);
+
+#pragma omp parallel for
+            for (int q = 0; q < queries.size(); q++) {
+                // ties are ordered by id, independently of the layout on disk
+                set<pair<double, int>> result_set;
+                for (const auto& slot : candidates.slots[q]) {
+                    const auto& data = candidates.record(slot);
+                    const auto dist = hash.distance_function(queries[q], data);
+                    result_set.emplace(dist, data.id);
+
+                    if (result_set.size() > k) result_set.erase(--result_set.cend());
+                }
+
+                auto& result = candidates.results[q];
+                for (const auto& pair : result_set) result.result.emplace_back(pair.second);
+            }
+
+            return finish(candidates.results, start);
+        }
+
+        auto knn_search(const Data<>& query, int k) {
+            return knn_search(Dataset<>{query}, k)[0];
+        }
+
+        struct Candidates {
+            vector<SearchResult> results;
+            vector<vector<Slot>> slots; // distinct slots of each query, ascending
+            vector<Slot> all_slots;     // union of slots, ascending
+            Dataset<> records;              // records of all_slots
+
+            const Data<>& record(Slot slot) const {
+                const auto it = lower_bound(all_slots.begin(), all_slots.end(), slot);
+                return records[it - all_slots.begin()];
+            }
+        };
+
+        Candidates gather(const Dataset<>& queries) {
+            const auto n_query = queries.size();
+            auto candidates = Candidates();
+            candidates.results.resize(n_query);
+            candidates.slots.resize(n_query);
+
+            auto keys = vector<BucketKeys>(n_query);
+#pragma omp parallel for
+            for (int q = 0; q < n_query; q++) keys[q] = hash.hash_keys(queries[q]);
+
+            // bucket contents: hot buckets from memory, the rest read in parallel
+            unordered_map<BucketKeys, vector<Slot>, BucketKeysHash> contents;
+            vector<pair<BucketKeys, BucketRef>> misses;
+            for (int q = 0; q < n_query; q++) {
+                for (int t = 0; t < hash.L; t++) {
+                    const auto ref = directory[t].find(keys[q][t]);
+                    if (ref == directory[t].end()) continue;
+                    const auto bucket = BucketKeys{{t}, keys[q][t]};
+                    if (contents.count(bucket)) continue;
+                    auto& slots = contents[bucket];
+                    if (hot_buckets.find(bucket, slots)) n_bucket_hit++;
+                    else misses.emplace_back(bucket, ref->second);
+                }
+            }
+
+#pragma omp parallel for
+            for (int i = 0; i < misses.size(); i++) {
+                const auto& ref = misses[i].second;
+                auto slots = vector<Slot>(ref.size);
+                bucket_file.read(slots.data(), ref.size * sizeof(Slot), ref.offset);
+#pragma omp critical
+                contents[misses[i].first] = move(slots);
+            }
+
+            for (const auto& miss : misses) {
+                // a bucket depends only on itself; its cost is its number of slots
+                const auto t = miss.first[0][0];
+                auto bucket_keys = BucketKeys(t + 1);
+                bucket_keys[t] = miss.first[1];
+                const auto& slots = contents[miss.first];
+                hot_buckets.insert(miss.first, slots, bucket_keys, max(static_cast<size_t>(1), slots.size()));
+                n_bucket_read++;
+                n_read++;
+                n_read_bytes += miss.second.size * sizeof(Slot);
+            }
+
+            for (int q = 0; q < n_query; q++) {
+                auto& slots = candidates.slots[q];
+                for (int t = 0; t < hash.L; t++) {
+                    const auto bucket = contents.find(BucketKeys{{t}, keys[q][t]});
+                    if (bucket == contents.end()) continue;
+                    slots.insert(slots.end(), bucket->second.begin(), bucket->second.end());
+                }
+                candidates.results[q].n_bucket_content = slots.size();
+                sort(slots.begin(), slots.end());
+                slots.erase(unique(slots.begin(), slots.end()), slots.end());
+                candidates.all_slots.insert(candidates.all_slots.end(), slots.begin(), slots.end());
+            }
+
+            auto& all_slots = candidates.all_slots;
+            sort(all_slots.begin(), all_slots.end());
+            all_slots.erase(unique(all_slots.begin(), all_slots.end()), all_slots.end());
+            candidates.records = read_records(all_slots);
+            return candidates;
+        }
+
+        // reads the records of ascending slots, one pread per run of nearby records;
+        // runs are split at max_run bytes so that reads spread over threads
+        Dataset<> read_records(const vector<Slot>& slots) {
+            const size_t max_gap_records = max(static_cast<size_t>(1), max_gap / record_size);
+            const size_t max_run_records = max(static_cast<size_t>(1), max_run / record_size);
+            vector<pair<size_t, size_t>> runs; // [begin, end) indices into slots
+            for (size_t i = 0; i < slots.size(); i++) {
+                if (runs.empty() || slots[i] - slots[i - 1] > max_gap_records ||
+                    slots[i] - slots[runs.back().first] >= max_run_records)
+                    runs.emplace_back(i, i + 1);
+                else runs.back().second = i + 1;
+            }
+
+            auto records = Dataset<>(slots.size());
+#pragma omp parallel for schedule(dynamic)
+            for (int r = 0; r < runs.size(); r++) {
+                const auto first = slots[runs[r].first], last = slots[runs[r].second - 1];
+                vector<char> buf((last - first + 1) * record_size);
+                vector_file.read(buf.data(), buf.size(), first * record_size);
+                for (auto i = runs[r].first; i < runs[r].second; i++) {
+                    records[i] = decode(buf.data() + (slots[i] - first) * record_size);
+                }
+            }
+
+            n_read += runs.size();
+            for (const auto& run : runs) {
+                n_read_bytes += (slots[run.second - 1] - slots[run.first] + 1) * record_size;
+            }
+            return records;
+        }
+
+        void encode(const Data<>& data, char* p) const {
+            const uint64_t id = data.id;
+            memcpy(p, &id, sizeof(id));
+            memcpy(p + sizeof(id), data.x.data(), dim * sizeof(double));
+        }
+
+        Data<> decode(const char* p) const {
+            uint64_t id;
+            memcpy(&id, p, sizeof(id));
+            auto x = vector<double>(dim);
+            memcpy(x.data(), p + sizeof(id), dim * sizeof(double));
+            return Data<>(id, x);
+        }
+
+        template <typename Buckets>
+        static vector<vector<int>> sorted_keys(const Buckets& buckets) {
+            vector<vector<int>> keys;
+            for (const auto& bucket : buckets) keys.emplace_back(bucket.first);
+            sort(keys.begin(), keys.end());
+            return keys;
+        }
+
+        void write_buckets(int t, const unordered_map<vector<int>, vector<Slot>, VectorHash>& buckets,
+                           uint64_t& offset) {
+            vector<Slot> buf;
+            for (const auto& key : sorted_keys(buckets)) {
+                const auto& slots = buckets.at(key);
+                directory[t][key] = BucketRef{offset + buf.size() * sizeof(Slot),
+                                              static_cast<uint64_t>(slots.size())};
+                buf.insert(buf.end(), slots.begin(), slots.end());
+            }
+            bucket_file.write(buf.data(), buf.size() * sizeof(Slot), offset);
+            offset += buf.size() * sizeof(Slot);
+        }
+
+        void load_projections() {
+            ifstream ifs(dir + "/projections.bin", ios::binary);
+            if (!ifs) throw runtime_error("Can't open file!");
+            uint64_t dim_;
+            ifs.read(reinterpret_cast<char*>(&dim_), sizeof(dim_));
+            auto projections = vector<vector<Projection>>(hash.L, vector<Projection>(hash.m));
+            for (auto& family : projections) {
+                for (auto& projection : family) {
+                    projection.a.resize(dim_);
+                    ifs.read(reinterpret_cast<char*>(projection.a.data()), dim_ * sizeof(double));
+                    ifs.read(reinterpret_cast<char*>(&projection.b), sizeof(projection.b));
+                }
+            }
+            if (!ifs) throw runtime_error("Can't read file!");
+            hash.create_hash_families(projections);
+        }
+
+        void save_projections() const {
+            ofstream ofs(dir + "/projections.bin", ios::binary);
+            const uint64_t dim_ = dim;
+            ofs.write(reinterpret_cast<const char*>(&dim_), sizeof(dim_));
+            for (const auto& family : hash.projections) {
+                for (const auto& projection : family) {
+                    ofs.write(reinterpret_cast<const char*>(projection.a.data()), dim * sizeof(double));
+                    ofs.write(reinterpret_cast<const char*>(&projection.b), sizeof(projection.b));
+                }
+            }
+        }
+
+        void save_meta() const {
+            save_projections();
+
+            json meta;
+            meta["n"] = n;
+            meta["dim"] = dim;
+            meta["m"] = hash.m;
+            meta["w"] = hash.w;
+            meta["L"] = hash.L;
+            meta["distance"] = hash.distance_type;
+            ofstream(dir + "/meta.json") << meta.dump(2) << endl;
+
+            ofstream ofs(dir + "/directory.bin", ios::binary);
+            for (int t = 0; t < hash.L; t++) {
+                const uint64_t n_bucket = directory[t].size();
+                ofs.write(reinterpret_cast<const char*>(&n_bucket), sizeof(n_bucket));
+                for (const auto& entry : directory[t]) {
+                    ofs.write(reinterpret_cast<const char*>(entry.first.data()), hash.m * sizeof(int));
+                    ofs.write(reinterpret_cast<const char*>(&entry.second.offset), sizeof(entry.second.offset));
+                    ofs.write(reinterpret_cast<const char*>(&entry.second.size), sizeof(entry.second.size));
+                }
+            }
+        }
+
+        static vector<SearchResult> finish(vector<SearchResult>& results,
+                                           chrono::system_clock::time_point start) {
+            const auto end = get_now();
+            const auto time = get_duration(start, end) / max(static_cast<size_t>(1), results.size());
+            for (auto& result : results) result.time = time;
+            return results;
+        }
+    };
+}
+
+#endif //LSH_DISK_LSH_HPP
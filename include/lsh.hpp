@@ -12,6 +12,10 @@
 #include <random>
 #include <chrono>
 #include <numeric>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_set>
 #include <arailib.hpp>
 
 using namespace std;
@@ -40,6 +44,16 @@ namespace lsh {
         unsigned long n_distinct_node_access = 0;
     };
 
+    struct CountResult {
+        time_t time = 0;
+        double count = 0;
+        double lower = 0;
+        double upper = 0;
+        unsigned long n_bucket_content = 0;
+        unsigned long n_candidate = 0;
+        unsigned long n_verified = 0;
+    };
+
     struct SearchResults {
         vector<SearchResult> results;
         void push_back(const SearchResult& result) { results.push_back(result); }
@@ -75,6 +89,184 @@ namespace lsh {
         }
     };
 
+    using BucketKeys = vector<vector<int>>;
+
+    // FNV-1a over raw bytes, used as the digest of query vectors and bucket keys
+    inline size_t fnv1a(const void* bytes, size_t size, size_t digest = 14695981039346656037ULL) {
+        const auto p = static_cast<const unsigned char*>(bytes);
+        for (size_t i = 0; i < size; i++) {
+            digest ^= p[i];
+            digest *= 1099511628211ULL;
+        }
+        return digest;
+    }
+
+    struct QueryKey {
+        vector<double> x;
+        int k = 0; // -1 for range search
+        double range = 0;
+
+        bool operator==(const QueryKey& o) const {
+            return k == o.k && range == o.range && x == o.x;
+        }
+    };
+
+    struct QueryKeyHash {
+        size_t operator () (const QueryKey& key) const {
+            auto digest = fnv1a(key.x.data(), key.x.size() * sizeof(double));
+            digest = fnv1a(&key.k, sizeof(key.k), digest);
+            return fnv1a(&key.range, sizeof(key.range), digest);
+        }
+    };
+
+    struct BucketKeysHash {
+        size_t operator () (const BucketKeys& keys) const {
+            size_t digest = 14695981039346656037ULL;
+            for (const auto& key : keys) digest = fnv1a(key.data(), key.size() * sizeof(int), digest);
+            return digest;
+        }
+    };
+
+    // LRU map whose entries remember the bucket keys they were computed from,
+    // so that an insert into one of those buckets drops them. Each entry has a
+    // cost (1 unless given), and the total cost is kept within capacity.
+    template <typename Key, typename Value, typename Hash>
+    struct LRUCache {
+        struct Entry {
+            Key key;
+            Value value;
+            BucketKeys bucket_keys; // empty when the value depends on every bucket;
+                                    // an empty key means no bucket of that table
+            size_t cost;
+        };
+
+        size_t capacity;
+        size_t total_cost = 0;
+        list<Entry> entries; // most recently used first
+        unordered_map<Key, typename list<Entry>::iterator, Hash> index;
+        // dependents[t][key]: entries that read bucket key of table t
+        vector<unordered_map<vector<int>, unordered_set<Entry*>, VectorHash>> dependents;
+        unordered_set<Entry*> global_entries; // entries with empty bucket_keys
+        unsigned long n_hit = 0, n_miss = 0;
+
+        explicit LRUCache(size_t capacity) : capacity(capacity) {}
+
+        bool find(const Key& key, Value& value) {
+            const auto it = index.find(key);
+            if (it == index.end()) {
+                n_miss++;
+                return false;
+            }
+            entries.splice(entries.begin(), entries, it->second);
+            value = it->second->value;
+            n_hit++;
+            return true;
+        }
+
+        void insert(const Key& key, const Value& value, const BucketKeys& bucket_keys,
+                    size_t cost = 1) {
+            if (cost > capacity) return;
+            const auto it = index.find(key);
+            if (it != index.end()) erase(it->second);
+
+            entries.push_front(Entry{key, value, bucket_keys, cost});
+            index[key] = entries.begin();
+            total_cost += cost;
+            Entry* entry = &entries.front();
+            if (bucket_keys.empty()) global_entries.insert(entry);
+            if (dependents.size() < bucket_keys.size()) dependents.resize(bucket_keys.size());
+            for (size_t t = 0; t < bucket_keys.size(); t++) {
+                if (!bucket_keys[t].empty()) dependents[t][bucket_keys[t]].insert(entry);
+            }
+
+            while (total_cost > capacity) erase(prev(entries.end()));
+        }
+
+        // drop entries that read any bucket in keys (one key per table)
+        void invalidate(const BucketKeys& keys) {
+            auto stale = global_entries;
+            for (size_t t = 0; t < keys.size() && t < dependents.size(); t++) {
+                const auto bucket = dependents[t].find(keys[t]);
+                if (bucket != dependents[t].end()) stale.insert(bucket->second.begin(), bucket->second.end());
+            }
+            for (const auto entry : stale) erase(index.at(entry->key));
+        }
+
+        void erase(typename list<Entry>::iterator it) {
+            Entry* entry = &*it;
+            global_entries.erase(entry);
+            for (size_t t = 0; t < entry->bucket_keys.size(); t++) {
+                if (entry->bucket_keys[t].empty()) continue;
+                const auto bucket = dependents[t].find(entry->bucket_keys[t]);
+                bucket->second.erase(entry);
+                if (bucket->second.empty()) dependents[t].erase(bucket);
+            }
+            total_cost -= entry->cost;
+            index.erase(entry->key);
+            entries.erase(it);
+        }
+    };
+
+    struct CacheStats {
+        unsigned long n_hit = 0, n_miss = 0;
+        unsigned long n_candidate_hit = 0, n_candidate_miss = 0;
+    };
+
+    // Search results keyed on the query vector (capacity counts entries), and
+    // optionally distinct bucket contents keyed on the bucket keys of all tables
+    // (candidate_capacity counts stored data ids). Thread-safe.
+    struct QueryCache {
+        LRUCache<QueryKey, SearchResult, QueryKeyHash> results;
+        LRUCache<BucketKeys, vector<int>, BucketKeysHash> candidates;
+        mutex mtx;
+
+        QueryCache(size_t capacity, size_t candidate_capacity) :
+                results(capacity), candidates(candidate_capacity) {}
+
+        bool find(const QueryKey& key, SearchResult& result) {
+            lock_guard<mutex> lock(mtx);
+            return results.find(key, result);
+        }
+
+        void insert(const QueryKey& key, const SearchResult& result, const BucketKeys& bucket_keys) {
+            lock_guard<mutex> lock(mtx);
+            results.insert(key, result, bucket_keys);
+        }
+
+        bool find(const BucketKeys& keys, vector<int>& contents) {
+            lock_guard<mutex> lock(mtx);
+            if (candidates.capacity == 0) return false;
+            return candidates.find(keys, contents);
+        }
+
+        void insert(const BucketKeys& keys, const vector<int>& contents) {
+            lock_guard<mutex> lock(mtx);
+            candidates.insert(keys, contents, keys, max(static_cast<size_t>(1), contents.size()));
+        }
+
+        void invalidate(const BucketKeys& keys) {
+            lock_guard<mutex> lock(mtx);
+            results.invalidate(keys);
+            candidates.invalidate(keys);
+        }
+
+        CacheStats stats() {
+            lock_guard<mutex> lock(mtx);
+            auto stats = CacheStats();
+            stats.n_hit = results.n_hit;
+            stats.n_miss = results.n_miss;
+            stats.n_candidate_hit = candidates.n_hit;
+            stats.n_candidate_miss = candidates.n_miss;
+            return stats;
+        }
+    };
+
+    // one hash function: h(p) = (a . p + b) / w, truncated to int
+    struct Projection {
+        vector<double> a;
+        double b;
+    };
+
     struct LSHIndex {
         const int m, L;
         int dim;
@@ -83,8 +275,13 @@ namespace lsh {
         const double w;
         Dataset<> dataset;
         vector<HashFamilyFunc> G;
+        vector<vector<Projection>> projections; // parameters of G, [table][hash function]
         vector<HashTable> hash_tables;
         mt19937 engine;
+        // fall back to an exact scan once distinct candidates reach this fraction of n
+        double scan_ratio = 0.8;
+        vector<double> data_norms; // squared norms of dataset, for the exact scan
+        unique_ptr<QueryCache> cache;
 
         LSHIndex(int n_hash_func_, double w, int L,
                  string distance = "euclidean") :
@@ -93,7 +290,7 @@ namespace lsh {
                 hash_tables(vector<unordered_map<vector<int>, vector<int>, VectorHash>>(L)),
                 engine(42) {}
 
-        HashFunc create_hash_func() {
+        Projection create_projection() {
             cauchy_distribution<double> cauchy_dist(0, 1);
             normal_distribution<double> norm_dist(0, 1);
             uniform_real_distribution<double> unif_dist(0, w);
@@ -109,6 +306,13 @@ namespace lsh {
             }();
 
             const auto b = unif_dist(engine);
+            return Projection{a, b};
+        }
+
+        HashFunc create_hash_func(const Projection& projection) const {
+            const auto a = projection.a;
+            const auto b = projection.b;
+            const auto w = this->w;
 
             if (distance_type == "angular") {
                 return [=](const Data<>& p) {
@@ -124,10 +328,10 @@ namespace lsh {
             }
         }
 
-        HashFamilyFunc create_hash_family() {
+        HashFamilyFunc create_hash_family(const vector<Projection>& family) const {
             vector<HashFunc> hash_funcs;
-            for (int i = 0; i < m; i++) {
-                const auto h = create_hash_func();
+            for (const auto& projection : family) {
+                const auto h = create_hash_func(projection);
                 hash_funcs.push_back(h);
             }
 
@@ -138,7 +342,7 @@ namespace lsh {
             };
         }
 
-        Data<> normalize(const Data<>& data) const {
+        static Data<> normalize(const Data<>& data) {
             auto normalized = vector<double>(data.size(), 0);
             const auto origin = Data<>(data.id, vector<double>(data.size(), 0));
             const double norm = euclidean_distance(data, origin);
@@ -149,20 +353,55 @@ namespace lsh {
         }
 
         void insert(const Data<>& data) {
+            auto keys = BucketKeys(L);
 #pragma omp parallel for
             for (int i = 0; i < L; i++) {
-                const auto key = G[i](data);
+                keys[i] = G[i](data);
                 auto& hash_table = hash_tables[i];
-                auto& val = hash_table[key];
+                auto& val = hash_table[keys[i]];
                 val.emplace_back(data.id);
             }
+            if (cache) cache->invalidate(keys);
+        }
+
+        // cache up to capacity search results; with candidate_capacity > 0, also
+        // reuse distinct bucket contents of queries that hash to the same buckets,
+        // keeping up to candidate_capacity data ids in total
+        void enable_cache(size_t capacity, size_t candidate_capacity = 0) {
+            cache.reset(new QueryCache(capacity, candidate_capacity));
+        }
+
+        CacheStats cache_stats() const {
+            return cache ? cache->stats() : CacheStats();
+        }
+
+        // draws m random projections per table
+        void create_hash_families(int dim_) {
+            dim = dim_;
+            auto projections_ = vector<vector<Projection>>(L);
+            for (auto& family : projections_) {
+                for (int i = 0; i < m; i++) family.push_back(create_projection());
+            }
+            create_hash_families(projections_);
+        }
+
+        // restores hash families from saved projections
+        void create_hash_families(const vector<vector<Projection>>& projections_) {
+            projections = projections_;
+            dim = projections[0][0].a.size();
+            G.clear();
+            for (const auto& family : projections) G.push_back(create_hash_family(family));
         }
 
         void build(const Dataset<>& in_dataset) {
             // set hash function
             dataset = in_dataset;
-            dim = dataset[0].size();
-            for (int i = 0; i < L; i++) G.push_back(create_hash_family());
+            create_hash_families(dataset[0].size());
+            data_norms = squared_norms(dataset);
+
+            // buckets and cached results of a previous build used other projections
+            hash_tables = vector<HashTable>(L);
+            if (cache) enable_cache(cache->results.capacity, cache->candidates.capacity);
 
             // insert dataset into hash table
             for (auto& data : dataset) insert(data);
@@ -179,9 +418,11 @@ namespace lsh {
             bool is_enough = false;
 
             for (int i = 0; i < L; i++) {
-                HashTable& hash_table = hash_tables[i];
+                const HashTable& hash_table = hash_tables[i];
                 const auto key = G[i](query);
-                for (const auto& data_id : hash_table[key]) {
+                const auto bucket = hash_table.find(key);
+                if (bucket == hash_table.end()) continue;
+                for (const auto& data_id : bucket->second) {
                     result.emplace_back(data_id);
                     if (limit != -1 && result.size() >= limit) {
                         is_enough = true;
@@ -193,22 +434,74 @@ namespace lsh {
             return result;
         }
 
+        bool is_scan_cheaper(unsigned long n_candidate) const {
+            return n_candidate >= scan_ratio * dataset.size();
+        }
+
+        BucketKeys hash_keys(const Data<>& query) const {
+            auto keys = BucketKeys();
+            for (int i = 0; i < L; i++) keys.emplace_back(G[i](query));
+            return keys;
+        }
+
+        unsigned long count_bucket_contents(const BucketKeys& keys) const {
+            unsigned long n_bucket_content = 0;
+            for (int i = 0; i < L; i++) {
+                const auto bucket = hash_tables[i].find(keys[i]);
+                if (bucket != hash_tables[i].end()) n_bucket_content += bucket->second.size();
+            }
+            return n_bucket_content;
+        }
+
+        // bucket contents of keys without duplicates, in order of first appearance
+        vector<int> distinct_bucket_contents(const BucketKeys& keys) {
+            vector<int> contents;
+            if (cache && cache->find(keys, contents)) return contents;
+
+            unordered_map<size_t, bool> checked;
+            for (int i = 0; i < L; i++) {
+                const auto bucket = hash_tables[i].find(keys[i]);
+                if (bucket == hash_tables[i].end()) continue;
+                for (const auto& data_id : bucket->second) {
+                    if (checked[data_id]) continue;
+                    checked[data_id] = true;
+                    contents.emplace_back(data_id);
+                }
+            }
+
+            // a query that falls back to the exact scan never reads the list again
+            if (cache && !is_scan_cheaper(contents.size())) cache->insert(keys, contents);
+            return contents;
+        }
+
         auto range_search(const Data<>& query, double range) {
             const auto start = get_now();
             auto result = SearchResult();
 
-            unordered_map<size_t, bool> checked;
-            const auto bucket_contents = find(query);
-            result.n_bucket_content += bucket_contents.size();
+            const auto cache_key = QueryKey{query.x, -1, range};
+            if (cache && cache->find(cache_key, result)) {
+                result.time = get_duration(start, get_now());
+                return result;
+            }
 
-            for (const auto& data_id : bucket_contents) {
-                if (checked[data_id]) continue;
-                checked[data_id] = true;
-                const auto& data = dataset[data_id];
-                if (distance_function(query, data) < range)
-                    result.result.emplace_back(data_id);
+            const auto keys = hash_keys(query);
+            result.n_bucket_content = count_bucket_contents(keys);
+
+            const auto candidates = distinct_bucket_contents(keys);
+            const bool is_scanned = is_scan_cheaper(candidates.size());
+            if (is_scanned) {
+                for (const auto& data : scan_range_search(query, range, dataset, distance_type, data_norms))
+                    result.result.emplace_back(data.get().id);
+            } else {
+                for (const auto& data_id : candidates) {
+                    const auto& data = dataset[data_id];
+                    if (distance_function(query, data) < range)
+                        result.result.emplace_back(data_id);
+                }
             }
 
+            if (cache) cache->insert(cache_key, result, is_scanned ? BucketKeys() : keys);
+
             const auto end = get_now();
             result.time = get_duration(start, end);
             return result;
@@ -218,29 +511,240 @@ namespace lsh {
             const auto start = get_now();
             auto result = SearchResult();
 
-            unordered_map<size_t, bool> checked;
-            multimap<double, int> result_map;
+            const auto cache_key = QueryKey{query.x, k, 0};
+            if (cache && cache->find(cache_key, result)) {
+                result.time = get_duration(start, get_now());
+                return result;
+            }
+
+            const auto keys = hash_keys(query);
+            result.n_bucket_content = count_bucket_contents(keys);
+
+            const auto candidates = distinct_bucket_contents(keys);
+            const bool is_scanned = is_scan_cheaper(candidates.size());
+            if (is_scanned) {
+                for (const auto& data : scan_knn_search(query, k, dataset, distance_type, data_norms))
+                    result.result.emplace_back(data.get().id);
+            } else {
+                multimap<double, int> result_map;
+                for (const auto& data_id : candidates) {
+                    const auto& data = dataset[data_id];
+                    const auto dist = distance_function(query, data);
+                    result_map.emplace(dist, data_id);
+
+                    if (result_map.size() > k) result_map.erase(--result_map.cend());
+                }
+
+                for (const auto& pair : result_map) result.result.emplace_back(pair.second);
+            }
+
+            if (cache) cache->insert(cache_key, result, is_scanned ? BucketKeys() : keys);
+
+            const auto end = get_now();
+            result.time = get_duration(start, end);
+            return result;
+        }
 
-            const auto bucket_contents = find(query);
-            result.n_bucket_content = bucket_contents.size();
+        // map from data id to the number of tables in which it collides with query
+        auto count_collisions(const Data<>& query, unsigned long& n_bucket_content) const {
+            unordered_map<int, int> collisions;
+            for (int i = 0; i < L; i++) {
+                const HashTable& hash_table = hash_tables[i];
+                const auto bucket = hash_table.find(G[i](query));
+                if (bucket == hash_table.end()) continue;
+                n_bucket_content += bucket->second.size();
+                for (const auto& data_id : bucket->second) collisions[data_id]++;
+            }
+            return collisions;
+        }
 
-            for (const auto& data_id : bucket_contents) {
-                if (checked[data_id]) continue;
-                checked[data_id] = true;
+        // offset (a.p + b) / w of the query under every hash function, per table
+        vector<vector<double>> hash_offsets(const Data<>& query) const {
+            const auto q = (distance_type == "angular") ? normalize(query) : query;
+            auto offsets = vector<vector<double>>(L);
+            for (int i = 0; i < L; i++) {
+                for (const auto& projection : projections[i]) {
+                    const auto ip = inner_product(q.begin(), q.end(), projection.a.begin(), 0.0);
+                    offsets[i].push_back((ip + projection.b) / w);
+                }
+            }
+            return offsets;
+        }
 
-                const auto& data = dataset[data_id];
-                const auto dist = distance_function(query, data);
-                result_map.emplace(dist, data_id);
+        // Probability that a point at distance c shares the query's bucket, per table.
+        // The hash truncates toward zero, so the query's bucket is [k, k + 1) for
+        // k > 0, (k - 1, k] for k < 0 and (-1, 1) for k = 0. The point's offset
+        // differs from the query's by c / w times a Cauchy variable for manhattan,
+        // and, for a random direction, by c |a| / (w sqrt(dim)) times a normal
+        // variable otherwise.
+        vector<double> table_collision_probabilities(const vector<vector<double>>& offsets,
+                                                     double c) const {
+            auto probabilities = vector<double>(L, 1);
+            if (distance_type == "angular") c = 2 * sin(min(c, 1.0) * pi / 2);
+            if (c <= 0) return probabilities;
+            const bool is_manhattan = distance_type == "manhattan";
+            const auto cdf = [&](double x) {
+                if (is_manhattan) return 0.5 + atan(x) / pi;
+                return 0.5 * erfc(-x / sqrt(2.0));
+            };
+            for (int i = 0; i < L; i++) {
+                for (int j = 0; j < m; j++) {
+                    const auto& a = projections[i][j].a;
+                    const double scale = is_manhattan ? 1 :
+                            sqrt(inner_product(a.begin(), a.end(), a.begin(), 0.0) / dim);
+                    const double s = c * scale / w;
+                    const double u = offsets[i][j];
+                    const int k = static_cast<int>(u);
+                    const double lo = (k > 0) ? k : k - 1;
+                    const double hi = (k < 0) ? k : k + 1;
+                    probabilities[i] *= cdf((hi - u) / s) - cdf((lo - u) / s);
+                }
+            }
+            return probabilities;
+        }
 
-                if (result_map.size() > k) result_map.erase(--result_map.cend());
+        // distribution of the number of tables a point collides in (Poisson binomial)
+        static vector<double> collision_count_distribution(const vector<double>& probabilities) {
+            auto distribution = vector<double>(probabilities.size() + 1, 0);
+            distribution[0] = 1;
+            for (size_t i = 0; i < probabilities.size(); i++) {
+                const double p = probabilities[i];
+                for (size_t c = i + 1; c > 0; c--)
+                    distribution[c] = distribution[c] * (1 - p) + distribution[c - 1] * p;
+                distribution[0] *= 1 - p;
             }
+            return distribution;
+        }
 
-            for (const auto& pair : result_map) result.result.emplace_back(pair.second);
+        // mode: "exact" verifies all candidates, "sample" verifies n_sample of them
+        // and extrapolates, "collision" estimates from collision counts only.
+        // For "sample", lower and upper are a 95% Wilson interval on the sampled
+        // fraction. For "collision", they are 0 and n: the estimate is a model fit
+        // without a confidence interval.
+        auto range_count(const Data<>& query, double range,
+                         const string& mode = "exact", int n_sample = 100) const {
+            if (mode == "sample" && n_sample < 1) throw runtime_error("n_sample must be positive");
+            const auto start = get_now();
+            auto result = CountResult();
+            const double z = 1.96;
+
+            const auto collisions = count_collisions(query, result.n_bucket_content);
+            result.n_candidate = collisions.size();
+
+            if (mode == "exact" && is_scan_cheaper(result.n_candidate)) {
+                result.count = result.lower = result.upper =
+                        scan_range_search(query, range, dataset, distance_type, data_norms).size();
+                result.n_verified = dataset.size();
+            } else if (mode == "exact" || mode == "sample") {
+                vector<int> candidates;
+                for (const auto& pair : collisions) candidates.emplace_back(pair.first);
+                sort(candidates.begin(), candidates.end());
+
+                const auto n_candidate = candidates.size();
+                auto n_verify = n_candidate;
+                if (mode == "sample" && static_cast<size_t>(n_sample) < n_candidate) {
+                    mt19937 sampler(query.id);
+                    for (int i = 0; i < n_sample; i++) {
+                        uniform_int_distribution<size_t> dist(i, n_candidate - 1);
+                        swap(candidates[i], candidates[dist(sampler)]);
+                    }
+                    n_verify = n_sample;
+                }
+
+                unsigned long n_hit = 0;
+                for (size_t i = 0; i < n_verify; i++) {
+                    if (distance_function(query, dataset[candidates[i]]) < range) n_hit++;
+                }
+                result.n_verified = n_verify;
+
+                if (n_verify == n_candidate) {
+                    result.count = result.lower = result.upper = n_hit;
+                } else {
+                    // Wilson score interval with finite population correction,
+                    // applied as an effective sample size of n_verify / fpc
+                    const double p = static_cast<double>(n_hit) / n_verify;
+                    const double fpc = static_cast<double>(n_candidate - n_verify) / (n_candidate - 1);
+                    const double n_effective = n_verify / fpc;
+                    const double z2 = z * z / n_effective;
+                    const double center = (p + z2 / 2) / (1 + z2);
+                    const double half = z / (1 + z2) *
+                            sqrt(p * (1 - p) / n_effective + z2 / (4 * n_effective));
+                    result.count = p * n_candidate;
+                    result.lower = min(max((center - half) * n_candidate, static_cast<double>(n_hit)),
+                                       result.count);
+                    result.upper = max(min((center + half) * n_candidate,
+                                           static_cast<double>(n_candidate - (n_verify - n_hit))),
+                                       result.count);
+                }
+            } else if (mode == "collision") {
+                // histogram of collision counts over all n points; points that are
+                // not candidates collide in no table
+                auto histogram = vector<double>(L + 1, 0);
+                for (const auto& pair : collisions) histogram[pair.second]++;
+                histogram[0] = dataset.size() - collisions.size();
+
+                // mixture over a grid of distances up to 3 * range, plus one cell for
+                // points too far to collide at all; each cell predicts the distribution
+                // of collision counts of a point at that distance from the query
+                const int n_grid = 48;
+                const auto grid_distance = [&](int g) { return 3 * range * (g + 0.5) / n_grid; };
+                const auto offsets = hash_offsets(query);
+                auto likelihoods = vector<vector<double>>();
+                for (int g = 0; g < n_grid; g++) {
+                    const auto probabilities = table_collision_probabilities(offsets, grid_distance(g));
+                    likelihoods.push_back(collision_count_distribution(probabilities));
+                }
+                auto far = vector<double>(L + 1, 0);
+                far[0] = 1;
+                likelihoods.push_back(far);
+
+                // fit the cell weights to the histogram by EM
+                const double n = dataset.size();
+                auto weights = vector<double>(likelihoods.size(), 1.0 / likelihoods.size());
+                for (int iteration = 0; iteration < 200; iteration++) {
+                    auto next = vector<double>(weights.size(), 0);
+                    for (int c = 0; c <= L; c++) {
+                        if (histogram[c] == 0) continue;
+                        double total = 0;
+                        for (size_t g = 0; g < weights.size(); g++) total += weights[g] * likelihoods[g][c];
+                        if (total <= 0) continue;
+                        for (size_t g = 0; g < weights.size(); g++)
+                            next[g] += histogram[c] * weights[g] * likelihoods[g][c] / total;
+                    }
+                    double change = 0;
+                    for (size_t g = 0; g < weights.size(); g++) {
+                        next[g] /= n;
+                        change += abs(next[g] - weights[g]);
+                    }
+                    weights = next;
+                    if (change * n < 1e-3) break;
+                }
+
+                result.count = 0;
+                for (int g = 0; g < n_grid && grid_distance(g) < range; g++) result.count += weights[g] * n;
+                // the fit carries no error model, so only the trivial bounds hold
+                result.lower = 0;
+                result.upper = n;
+            } else throw runtime_error("invalid count mode");
 
             const auto end = get_now();
             result.time = get_duration(start, end);
             return result;
         }
+
+        auto range_count(const Dataset<>& queries, double range,
+                         const string& mode = "exact", int n_sample = 100) const {
+            if (mode != "exact" && mode != "sample" && mode != "collision")
+                throw runtime_error("invalid count mode");
+            if (mode == "sample" && n_sample < 1) throw runtime_error("n_sample must be positive");
+
+            auto results = vector<CountResult>(queries.size());
+#pragma omp parallel for
+            for (int i = 0; i < queries.size(); i++) {
+                results[i] = range_count(queries[i], range, mode, n_sample);
+            }
+            return results;
+        }
     };
 }
 
@@ -1,7 +1,10 @@
 #include <gtest/gtest.h>
 #include <random>
+#include <cstdlib>
+#include <dirent.h>
 #include <arailib.hpp>
 #include <lsh.hpp>
+#include <disk_lsh.hpp>
 
 using namespace std;
 using namespace arailib;
@@ -125,6 +128,14 @@ TEST(lsh, get_bucket_contents) {
 
     const auto bucket_contents_2 = index.find(query, limit);
     ASSERT_EQ(bucket_contents_2.size(), limit);
+
+    // a second build replaces the buckets of the first one
+    index.build(series_for_index);
+    for (const auto& hash_table : index.hash_tables) {
+        size_t n_content = 0;
+        for (const auto& bucket : hash_table) n_content += bucket.second.size();
+        ASSERT_EQ(n_content, series.size());
+    }
 }
 
 TEST(lsh, knn_search) {
@@ -182,4 +193,380 @@ TEST(lsh, knn_search_sift) {
     const string result_path = "/home/arai/workspace/result/knn-search/lsh/sift/data1m/k10/"
                                "result-m4r200L10.csv";
     results.save(log_path, result_path, k);
-}
\ No newline at end of file
+}
+TEST(lsh, range_count) {
+    const int k = 4, r = 3, L = 8;
+    const auto series = [&]() {
+        auto series_ = Series<>();
+        for (int i = 0; i < 10; i++) {
+            for (int j = 0; j < 10; j++) {
+                const auto id = (size_t)(10 * i + j);
+                const double x = i, y = j;
+                const auto point = Data<>(id, {x, y});
+                series_.push_back(point);
+            }
+        }
+        return series_;
+    }();
+    auto series_for_index = series;
+
+    auto index = LSHIndex(k, r, L);
+    index.build(series_for_index);
+
+    const auto query = Data<>(999, {4.5, 4.5});
+    const double range = 3;
+    const auto n_result = index.range_search(query, range).result.size();
+
+    const auto exact = index.range_count(query, range);
+    ASSERT_EQ(exact.count, n_result);
+    ASSERT_EQ(exact.lower, exact.upper);
+    ASSERT_EQ(exact.n_verified, exact.n_candidate);
+
+    const auto sampled = index.range_count(query, range, "sample", 10);
+    ASSERT_EQ(sampled.n_verified, 10);
+    ASSERT_LE(sampled.lower, sampled.count);
+    ASSERT_GE(sampled.upper, sampled.count);
+    ASSERT_LE(sampled.upper, sampled.n_candidate);
+
+    const auto collision = index.range_count(query, range, "collision");
+    ASSERT_EQ(collision.n_verified, 0);
+    ASSERT_LE(collision.lower, collision.count);
+    ASSERT_GE(collision.upper, collision.count);
+
+    const auto queries = Dataset<>{query, Data<>(1, {2.5, 7.5})};
+    const auto results = index.range_count(queries, range);
+    ASSERT_EQ(results.size(), queries.size());
+    ASSERT_EQ(results[0].count, exact.count);
+    ASSERT_EQ(results[1].count, index.range_search(queries[1], range).result.size());
+
+    ASSERT_THROW(index.range_count(query, range, "invalid"), runtime_error);
+    ASSERT_THROW(index.range_count(query, range, "sample", 0), runtime_error);
+    ASSERT_THROW(index.range_count(queries, range, "sample", -1), runtime_error);
+}
+
+TEST(lsh, range_count_collision) {
+    const int k = 4, r = 4, L = 10;
+    // unclustered data: distances to the query form a continuum
+    const auto series = [&]() {
+        mt19937 engine(1);
+        normal_distribution<double> dist(0, 1);
+        auto series_ = Series<>();
+        for (int i = 0; i < 5000; i++) {
+            auto x = vector<double>(16);
+            for (auto& xi : x) xi = dist(engine);
+            series_.push_back(Data<>(i, x));
+        }
+        return series_;
+    }();
+    auto series_for_index = series;
+
+    auto index = LSHIndex(k, r, L);
+    index.build(series_for_index);
+
+    // queries near the center, so that the data lie in random directions from them
+    mt19937 engine(2);
+    normal_distribution<double> dist(0, 0.1);
+    for (int q = 0; q < 5; q++) {
+        auto x = vector<double>(16);
+        for (auto& xi : x) xi = dist(engine);
+        const auto query = Data<>(q, x);
+
+        // the collision model predicts the total size of the query's buckets
+        const auto offsets = index.hash_offsets(query);
+        double n_predicted = 0;
+        for (const auto& data : series) {
+            const auto probabilities = index.table_collision_probabilities(
+                    offsets, euclidean_distance(query, data));
+            n_predicted += accumulate(probabilities.begin(), probabilities.end(), 0.0);
+        }
+        unsigned long n_bucket_content = 0;
+        index.count_collisions(query, n_bucket_content);
+        ASSERT_NEAR(n_predicted, n_bucket_content, 0.15 * n_bucket_content);
+
+        for (const double range : {3.5, 4.0, 4.5}) {
+            const auto n_exact = scan_range_search(query, range, series).size();
+            const auto estimated = index.range_count(query, range, "collision");
+            ASSERT_EQ(estimated.n_verified, 0);
+            ASSERT_NEAR(estimated.count, n_exact, 0.4 * n_exact);
+            ASSERT_LE(estimated.lower, n_exact);
+            ASSERT_GE(estimated.upper, n_exact);
+        }
+
+        // no candidate within range: the interval must contain the zero estimate
+        const auto sampled = index.range_count(query, 0.5, "sample", 50);
+        ASSERT_EQ(sampled.n_verified, 50);
+        ASSERT_EQ(sampled.count, 0);
+        ASSERT_EQ(sampled.lower, 0);
+        ASSERT_GT(sampled.upper, 0);
+        ASSERT_LE(sampled.upper, sampled.n_candidate - sampled.n_verified);
+    }
+}
+
+TEST(arailib, scan_knn_search) {
+    const auto series = [&]() {
+        auto series_ = Series<>();
+        for (int i = 0; i < 10; i++) {
+            for (int j = 0; j < 10; j++) {
+                const auto id = (size_t)(10 * i + j);
+                const double x = i, y = j;
+                const auto point = Data<>(id, {x, y});
+                series_.push_back(point);
+            }
+        }
+        return series_;
+    }();
+
+    // equal distances must not drop neighbours
+    const auto query = Data<>(999, {4.5, 4.5});
+    const auto result = scan_knn_search(query, 4, series);
+    ASSERT_EQ(result.size(), 4);
+    ASSERT_EQ(result[0].get().id, 44);
+    ASSERT_EQ(result[1].get().id, 45);
+    ASSERT_EQ(result[2].get().id, 54);
+    ASSERT_EQ(result[3].get().id, 55);
+
+    for (const auto& distance : {"euclidean", "manhattan", "angular"}) {
+        const auto df = select_distance(distance);
+        const auto queries = Dataset<>{Data<>(0, {1.2, 7.9}), Data<>(1, {8.1, 0.3})};
+        const auto results = scan_knn_search(queries, 10, series, distance);
+        ASSERT_EQ(results.size(), queries.size());
+        for (int i = 0; i < queries.size(); i++) {
+            auto dists = vector<double>();
+            for (const auto& data : series) {
+                const auto dist = df(queries[i], data);
+                if (!isnan(dist)) dists.push_back(dist);
+            }
+            sort(dists.begin(), dists.end());
+            ASSERT_EQ(results[i].size(), 10);
+            for (int j = 0; j < 10; j++) {
+                ASSERT_NEAR(df(queries[i], results[i][j]), dists[j], 1e-5);
+            }
+        }
+    }
+}
+
+TEST(arailib, scan_data_norms) {
+    const auto series = [&]() {
+        mt19937 engine(1);
+        normal_distribution<double> dist(0, 1);
+        auto series_ = Series<>();
+        for (int i = 0; i < 1000; i++) {
+            auto x = vector<double>(8);
+            for (auto& xi : x) xi = dist(engine);
+            series_.push_back(Data<>(i, x));
+        }
+        return series_;
+    }();
+    const auto norms = squared_norms(series);
+    const auto queries = Dataset<>{series[3], series[500], series[999]};
+
+    for (const auto& distance : {"euclidean", "angular"}) {
+        const auto batch = scan_knn_search(queries, 10, series, distance);
+        const auto batch_with_norms = scan_knn_search(queries, 10, series, distance, norms);
+        for (int i = 0; i < queries.size(); i++) {
+            const auto single = scan_knn_search(queries[i], 10, series, distance);
+            const auto single_with_norms = scan_knn_search(queries[i], 10, series, distance, norms);
+            for (int j = 0; j < 10; j++) {
+                ASSERT_EQ(single[j].get().id, batch[i][j].get().id);
+                ASSERT_EQ(single_with_norms[j].get().id, batch[i][j].get().id);
+                ASSERT_EQ(batch_with_norms[i][j].get().id, batch[i][j].get().id);
+            }
+        }
+    }
+
+    // an index that always falls back to the exact scan
+    auto series_for_index = series;
+    auto index = LSHIndex(4, 1, 2);
+    index.build(series_for_index);
+    index.scan_ratio = 0;
+    const auto result = index.knn_search(queries[1], 10);
+    const auto exact = scan_knn_search(queries[1], 10, series);
+    for (int j = 0; j < 10; j++) ASSERT_EQ(result.result[j], exact[j].get().id);
+}
+
+TEST(arailib, scan_range_search) {
+    const auto series = [&]() {
+        auto series_ = Series<>();
+        for (int i = 0; i < 10; i++) {
+            for (int j = 0; j < 10; j++) {
+                const auto id = (size_t)(10 * i + j);
+                const double x = i, y = j;
+                const auto point = Data<>(id, {x, y});
+                series_.push_back(point);
+            }
+        }
+        return series_;
+    }();
+
+    const auto query = Data<>(999, {4.5, 4.5});
+    ASSERT_EQ(scan_range_search(query, 1.5, series).size(), 4);
+    ASSERT_EQ(scan_range_search(query, 1.1, series, "manhattan").size(), 4);
+    ASSERT_EQ(scan_range_search(query, 2.1, series, "manhattan").size(), 12);
+}
+
+TEST(lsh, cache) {
+    const int k = 4, r = 3, L = 8;
+    const auto series = [&]() {
+        auto series_ = Series<>();
+        for (int i = 0; i < 10; i++) {
+            for (int j = 0; j < 10; j++) {
+                const auto id = (size_t)(10 * i + j);
+                const double x = i, y = j;
+                const auto point = Data<>(id, {x, y});
+                series_.push_back(point);
+            }
+        }
+        return series_;
+    }();
+    auto series_for_index = series;
+
+    auto index = LSHIndex(k, r, L);
+    index.build(series_for_index);
+    index.scan_ratio = 100;
+    index.enable_cache(10, 1000);
+
+    const auto query = Data<>(999, {4.5, 4.5});
+    const auto result_1 = index.range_search(query, 1.5);
+    const auto result_2 = index.range_search(query, 1.5);
+    ASSERT_EQ(result_1.result, result_2.result);
+    ASSERT_EQ(index.cache_stats().n_hit, 1);
+    ASSERT_EQ(index.cache_stats().n_miss, 1);
+
+    // same buckets, different range: candidates are reused
+    const auto result_3 = index.range_search(query, 2.5);
+    ASSERT_GT(result_3.result.size(), result_1.result.size());
+    ASSERT_EQ(index.cache_stats().n_candidate_hit, 1);
+
+    const auto knn_result = index.knn_search(query, 4);
+    ASSERT_EQ(knn_result.result, (vector<int>{44, 45, 54, 55}));
+    ASSERT_EQ(index.cache_stats().n_miss, 3);
+
+    // an insert into other buckets keeps them
+    index.insert(Data<>(0, {1000, -1000}));
+    index.range_search(query, 1.5);
+    ASSERT_EQ(index.cache_stats().n_hit, 2);
+
+    // an insert into the query's buckets drops its entries
+    index.insert(Data<>(44, {4.5, 4.5}));
+    index.range_search(query, 1.5);
+    ASSERT_EQ(index.cache_stats().n_hit, 2);
+    ASSERT_EQ(index.cache_stats().n_miss, 4);
+
+    // candidate lists larger than candidate_capacity are not kept
+    index.enable_cache(10, 1);
+    index.range_search(query, 1.5);
+    index.range_search(query, 2.5);
+    ASSERT_EQ(index.cache_stats().n_candidate_hit, 0);
+
+    // candidates of queries answered by the exact scan are not kept
+    index.enable_cache(10, 1000);
+    index.scan_ratio = 0;
+    index.range_search(query, 1.5);
+    index.range_search(query, 2.5);
+    ASSERT_EQ(index.cache_stats().n_candidate_hit, 0);
+}
+
+// a unique directory under /tmp, removed with its contents on destruction
+struct TemporaryDirectory {
+    string path;
+
+    TemporaryDirectory() {
+        char path_template[] = "/tmp/lsh-test-XXXXXX";
+        if (mkdtemp(path_template) == nullptr) throw runtime_error("Can't create directory!");
+        path = path_template;
+    }
+
+    ~TemporaryDirectory() { remove_all(path); }
+
+    static void remove_all(const string& path) {
+        DIR* dir = opendir(path.c_str());
+        if (dir == nullptr) return;
+        while (const auto entry = readdir(dir)) {
+            const string name = entry->d_name;
+            if (name == "." || name == "..") continue;
+            if (entry->d_type == DT_DIR) remove_all(path + "/" + name);
+            else unlink((path + "/" + name).c_str());
+        }
+        closedir(dir);
+        rmdir(path.c_str());
+    }
+};
+
+TEST(lsh, disk_index) {
+    const int k = 4, r = 3, L = 8;
+    const auto series = [&]() {
+        auto series_ = Series<>();
+        for (int i = 0; i < 10; i++) {
+            for (int j = 0; j < 10; j++) {
+                const auto id = (size_t)(10 * i + j);
+                const double x = i, y = j;
+                const auto point = Data<>(id, {x, y});
+                series_.push_back(point);
+            }
+        }
+        return series_;
+    }();
+    const auto tmp_dir = TemporaryDirectory();
+    const string data_path = tmp_dir.path + "/data.csv";
+    const string index_dir = tmp_dir.path + "/index";
+    write_csv(fmap([](const Data<>& data) { return data.x; }, series), data_path);
+
+    auto index = LSHIndex(k, r, L);
+    index.build(data_path, series.size());
+    index.scan_ratio = 100;
+
+    auto disk_index = DiskLSHIndex(k, r, L);
+    disk_index.build(data_path, series.size(), index_dir);
+
+    const auto queries = Dataset<>{Data<>(0, {4.5, 4.5}), Data<>(1, {1.2, 7.9})};
+    const auto sorted = [](vector<int> v) {
+        sort(v.begin(), v.end());
+        return v;
+    };
+
+    const auto results = disk_index.range_search(queries, 2.5);
+    ASSERT_EQ(results.size(), queries.size());
+    for (int i = 0; i < queries.size(); i++) {
+        ASSERT_EQ(sorted(results[i].result), sorted(index.range_search(queries[i], 2.5).result));
+    }
+    ASSERT_EQ(disk_index.knn_search(queries[0], 4).result, (vector<int>{44, 45, 54, 55}));
+    ASSERT_GT(disk_index.n_bucket_hit, 0);
+    ASSERT_TRUE(disk_index.hot_buckets.global_entries.empty());
+
+    auto reopened = DiskLSHIndex(k, r, L);
+    reopened.open(index_dir);
+    ASSERT_EQ(sorted(reopened.range_search(queries[1], 2.5).result), sorted(results[1].result));
+
+    ASSERT_THROW(DiskLSHIndex(k, r, L, "manhattan").open(index_dir), runtime_error);
+
+    // one record per read, and no room for hot buckets
+    auto small = DiskLSHIndex(k, r, L, "euclidean", 0);
+    small.open(index_dir);
+    small.max_run = 0;
+    const auto n_slot = small.gather(Dataset<>{queries[1]}).all_slots.size();
+    const auto n_read = small.n_read, n_bucket_read = small.n_bucket_read;
+    ASSERT_EQ(sorted(small.range_search(queries[1], 2.5).result), sorted(results[1].result));
+    ASSERT_EQ(small.n_bucket_hit, 0);
+    ASSERT_EQ(small.n_read - n_read - (small.n_bucket_read - n_bucket_read), n_slot);
+
+    // build and open start over on an index that is already in use
+    disk_index.open(index_dir);
+    ASSERT_EQ(disk_index.n_bucket_hit, 0);
+    ASSERT_EQ(sorted(disk_index.range_search(queries[1], 2.5).result), sorted(results[1].result));
+    disk_index.build(data_path, series.size(), index_dir);
+    ASSERT_EQ(disk_index.n, series.size());
+    auto rebuilt = DiskLSHIndex(k, r, L);
+    rebuilt.open(index_dir);
+    ASSERT_EQ(sorted(rebuilt.range_search(queries[0], 2.5).result),
+              sorted(disk_index.range_search(queries[0], 2.5).result));
+
+    // truncated files are rejected
+    ASSERT_EQ(truncate((index_dir + "/vectors.bin").c_str(), 0), 0);
+    ASSERT_THROW(DiskLSHIndex(k, r, L).open(index_dir), runtime_error);
+    ASSERT_EQ(truncate((index_dir + "/directory.bin").c_str(), 8), 0);
+    ASSERT_THROW(DiskLSHIndex(k, r, L).open(index_dir), runtime_error);
+
+    const string empty_path = tmp_dir.path + "/empty.csv";
+    ofstream(empty_path).close();
+    ASSERT_THROW(DiskLSHIndex(k, r, L).build(empty_path, 10, tmp_dir.path + "/empty"), runtime_error);
+}